@@ -32,8 +32,55 @@
 #include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/ioport.h>
+#include <linux/string.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/version.h>
+#include <linux/bitops.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/machine.h>
+#include <linux/platform_device.h>
+#include <linux/ktime.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 #include <asm/io.h>
 
+/*
+ * Fixed wiring build.
+ *
+ * Building with SNESCON_FIXED (make SNESCON_FIXED=1, see the Makefile) bakes the GPIO backend, the GPIO mapping
+ * and the enabled accessories into constants. The scan and decode then compile to straight-line code with
+ * immediate masks, direct GPIO calls and no accessory branches. The module parameters must match the build.
+ */
+#ifdef SNESCON_FIXED
+#ifndef SNESCON_FIXED_SOURCE
+#define SNESCON_FIXED_SOURCE raw
+#endif
+#ifndef SNESCON_FIXED_GPIO
+#define SNESCON_FIXED_GPIO 2, 3, 4, 7, 10, 11
+#endif
+#ifndef SNESCON_FIXED_MULTITAP
+#define SNESCON_FIXED_MULTITAP 1
+#endif
+#ifndef SNESCON_FIXED_FOURSCORE
+#define SNESCON_FIXED_FOURSCORE 1
+#endif
+#define DEFAULT_SOURCE __stringify(SNESCON_FIXED_SOURCE)
+#define DEFAULT_GPIO SNESCON_FIXED_GPIO
+#define DEFAULT_MULTITAP SNESCON_FIXED_MULTITAP
+#define DEFAULT_FOURSCORE SNESCON_FIXED_FOURSCORE
+#define ACCESSORY_PARAM_PERM S_IRUGO
+#else
+#define DEFAULT_SOURCE "raw"
+#define DEFAULT_GPIO 2, 3, 4, 7, 10, 11
+#define DEFAULT_MULTITAP 1
+#define DEFAULT_FOURSCORE 1
+#define ACCESSORY_PARAM_PERM (S_IRUGO | S_IWUSR)
+#endif
+
 /* _____ _____ _____ ____
   / ____|  __ \_   _/ __ \ 
  | |  __| |__) || || |  | |
@@ -52,55 +99,87 @@ static volatile unsigned *gpio;	// I/O access.
 #define GPIO_CLR *(gpio + 10)	// Clears bits which are 1 and ignores bits which are 0.
 
 #define BCM2708_PERI_BASE        0x20000000
-#define GPIO_BASE                (BCM2708_PERI_BASE + 0x200000) // GPIO controller.
+#define GPIO_OFFSET              0x200000 // GPIO controller, relative to the peripheral base.
+
+// Base address of the peripherals. 0x20000000 on Pi 1 and Zero, 0x3F000000 on Pi 2 and 3.
+static unsigned long peri_base = BCM2708_PERI_BASE;
 
 /*
  * All valid GPIOs found on the Raspberry Pi P1 Header.
  */
 static const unsigned char all_valid_gpio[] = { 0, 1, 2, 3, 4, 7, 8, 9, 10, 11, 14, 15, 17, 18, 21, 22, 25, 27 };
 
+// Number of GPIOs that fit in the bit masks used by the backends.
+#define NUMBER_OF_GPIO_BITS 32
+
+/*
+ * A GPIO backend. Every access to the GPIOs goes through the selected backend.
+ *
+ * raw: Direct register access to the GPIO controller. Fastest, BCM2835/BCM2836/BCM2837 only.
+ * sim: No hardware. Simulates a SNES gamepad on port 1 and port 2 so the driver can run on any Linux machine.
+ * gpiod: GPIO descriptors through gpiolib. Works on any board and with the gpio-sim module.
+ * replay: No GPIOs. Frames written by userspace to /dev/snescon_gpio_rpi are decoded instead of captured ones.
+ *
+ * set, clear and read operate on the bits in the GPIO register. read returns the level of all GPIOs.
+ * init sets gpio_sleeps if the GPIOs may only be accessed from a context that can sleep.
+ */
+struct gpio_backend {
+	const char *name;
+	int (* init) (const unsigned int *g_bits);
+	void (* exit) (void);
+	void (* set) (unsigned int g_bit);
+	void (* clear) (unsigned int g_bit);
+	void (* input) (unsigned int g_bit);
+	void (* output) (unsigned int g_bit);
+	void (* enable_pull_up) (unsigned int g_bit);
+	unsigned int (* read) (void);
+};
+
+static const struct gpio_backend *gpio_backend;
+static bool gpio_sleeps;
+
 /**
- * Set GPIO high.
+ * Set GPIO high in the GPIO controller.
  *
  * @param g_bit GPIO
  */
-static void gpio_set(unsigned int g_bit) {
+static void raw_set(unsigned int g_bit) {
 	GPIO_SET = g_bit;
 }
 
 /**
- * Set GPIO low.
+ * Set GPIO low in the GPIO controller.
  *
  * @param g_bit GPIO
  */
-static void gpio_clear(unsigned int g_bit) {
+static void raw_clear(unsigned int g_bit) {
 	GPIO_CLR = g_bit;
 }
 
 /**
- * Set GPIO as input
+ * Set GPIO as input in the GPIO controller.
  *
  * @param g_bit GPIO
  */
-static void gpio_input(unsigned int g_bit) {
+static void raw_input(unsigned int g_bit) {
 	INP_GPIO(g_bit);
 }
 
 /**
- * Set GPIO as output.
+ * Set GPIO as output in the GPIO controller.
  *
  * @param g_bit GPIO
  */
-static void gpio_output(unsigned int g_bit) {
+static void raw_output(unsigned int g_bit) {
 	OUT_GPIO(g_bit);
 }
 
 /**
- * Activate internal pull-up.
+ * Activate internal pull-up in the GPIO controller.
  * 
  * @param g_bit GPIO
  */
-static void gpio_enable_pull_up(unsigned int g_bit) {
+static void raw_enable_pull_up(unsigned int g_bit) {
 	*(gpio + 37) = 2;
 	udelay(10);
 	*(gpio + 38) = g_bit;
@@ -109,6 +188,515 @@ static void gpio_enable_pull_up(unsigned int g_bit) {
 	*(gpio + 38) = 0;
 }
 
+/**
+ * Read the level register of the GPIO controller.
+ *
+ * @return Status of all GPIOs
+ */
+static unsigned int raw_read(void) {
+	return *(gpio + 13);
+}
+
+/**
+ * Map the GPIO controller.
+ *
+ * @param g_bits Not used
+ * @return Result of the init operation
+ */
+static int raw_init(const unsigned int *g_bits) {
+	// Set up gpio pointer for direct register access.
+	if ((gpio = ioremap(peri_base + GPIO_OFFSET, 0xB0)) == NULL) {
+		pr_err("io remap failed\n");
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+/**
+ * Unmap the GPIO controller.
+ */
+static void raw_exit(void) {
+	iounmap(gpio);
+}
+
+static const struct gpio_backend backend_raw = {
+	.name = "raw",
+	.init = raw_init,
+	.exit = raw_exit,
+	.set = raw_set,
+	.clear = raw_clear,
+	.input = raw_input,
+	.output = raw_output,
+	.enable_pull_up = raw_enable_pull_up,
+	.read = raw_read,
+};
+
+#define SIM_PORTS 2
+#define SIM_BUTTONS_LENGTH 12
+#define SIM_SHIFT_LENGTH 16
+
+/*
+ * State of the simulated GPIOs.
+ *
+ * sim_buttons holds the pressed buttons of the simulated gamepad on <port 1, port 2>. Bit n is button n
+ * in the order the gamepad shifts them out: <B, Y, Select, Start, Up, Down, Left, Right, A, X, L, R>.
+ * It is writable from userspace (sysfs parameter) and may change at any time. It is latched into
+ * sim_shift when latch goes high, exactly like the shift register in the gamepad.
+ * port2_d1 is held low so no SNES Multitap is detected.
+ */
+static unsigned int sim_buttons[SIM_PORTS];
+static unsigned int sim_shift[SIM_PORTS];
+static unsigned int sim_pos;
+static unsigned int sim_level;
+static unsigned int sim_clk, sim_latch, sim_data[SIM_PORTS], sim_d1;
+
+/**
+ * Set simulated GPIO high. Latch high loads the shift registers and a rising clock shifts them.
+ *
+ * @param g_bit GPIO
+ */
+static void sim_set(unsigned int g_bit) {
+	int i;
+
+	if ((g_bit & sim_latch) && !(sim_level & sim_latch)) {
+		for (i = 0; i < SIM_PORTS; i++) {
+			sim_shift[i] = READ_ONCE(sim_buttons[i]);
+		}
+		sim_pos = 0;
+	} else if ((g_bit & sim_clk) && !(sim_level & sim_clk) && !(sim_level & sim_latch)) {
+		sim_pos++;
+	}
+	sim_level |= g_bit;
+}
+
+/**
+ * Set simulated GPIO low.
+ *
+ * @param g_bit GPIO
+ */
+static void sim_clear(unsigned int g_bit) {
+	sim_level &= ~g_bit;
+}
+
+/**
+ * Set GPIO as input or output, or activate pull-up, for a backend without real GPIOs. Nothing to do.
+ *
+ * @param g_bit GPIO
+ */
+static void nop_gpio(unsigned int g_bit) {
+}
+
+/**
+ * Read the level of all simulated GPIOs. Unused inputs are pulled up. The data line of a gamepad is low
+ * while a pressed button is shifted out and after the 16th bit.
+ *
+ * @return Status of all GPIOs
+ */
+static unsigned int sim_read(void) {
+	unsigned int level = ~sim_d1;
+	int i;
+
+	for (i = 0; i < SIM_PORTS; i++) {
+		if (sim_pos >= SIM_SHIFT_LENGTH ||
+		    (sim_pos < SIM_BUTTONS_LENGTH && (sim_shift[i] & (1 << sim_pos)))) {
+			level &= ~sim_data[i];
+		}
+	}
+	return level;
+}
+
+/**
+ * Setup the simulated gamepads.
+ *
+ * @param g_bits GPIO bits <clk, latch, port1_d0, port2_d0, ...>
+ * @return Result of the init operation
+ */
+static int sim_init(const unsigned int *g_bits) {
+	int i;
+
+	sim_clk = g_bits[0];
+	sim_latch = g_bits[1];
+	for (i = 0; i < SIM_PORTS; i++) {
+		sim_data[i] = g_bits[i + 2];
+	}
+	sim_d1 = g_bits[4];
+	sim_level = 0;
+	sim_pos = SIM_SHIFT_LENGTH;
+
+	pr_info("Using simulated gamepads\n");
+	return 0;
+}
+
+/**
+ * Nothing to tear down for a backend without real GPIOs.
+ */
+static void nop_exit(void) {
+}
+
+static const struct gpio_backend backend_sim = {
+	.name = "sim",
+	.init = sim_init,
+	.exit = nop_exit,
+	.set = sim_set,
+	.clear = sim_clear,
+	.input = nop_gpio,
+	.output = nop_gpio,
+	.enable_pull_up = nop_gpio,
+	.read = sim_read,
+};
+
+/**
+ * Read the GPIOs when replaying. Nothing is connected, all GPIOs are high.
+ *
+ * @return Status of all GPIOs
+ */
+static unsigned int replay_read(void) {
+	return ~0;
+}
+
+/**
+ * Nothing to set up when replaying.
+ *
+ * @param g_bits Not used
+ * @return Result of the init operation
+ */
+static int replay_init(const unsigned int *g_bits) {
+	pr_info("Replaying frames written to /dev/" KBUILD_MODNAME "\n");
+	return 0;
+}
+
+static const struct gpio_backend backend_replay = {
+	.name = "replay",
+	.init = replay_init,
+	.exit = nop_exit,
+	.set = nop_gpio,
+	.clear = nop_gpio,
+	.input = nop_gpio,
+	.output = nop_gpio,
+	.enable_pull_up = nop_gpio,
+	.read = replay_read,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+
+#define DESC_OUTPUTS 3
+#define DESC_INPUTS 3
+
+/*
+ * State of the gpiod backend.
+ *
+ * The GPIOs are requested as two descriptor arrays through a lookup table that maps the GPIO numbers to
+ * lines of desc_chip: desc_out <clk, latch, port2_pp>, always outputs, and desc_in <port1_d0, port2_d0,
+ * port2_d1>, the data lines. Each array is written or read with one gpiod_*_array_value() call. Passing
+ * the array info lets gpiolib set or get all lines with a single bitmap operation on the chip when the
+ * lines allow it. All access is done from process context, so the _cansleep variants are used.
+ * desc_out_values is the level of the output array, desc_out_bits and desc_in_bits the GPIO bits of the
+ * lines in the arrays. desc_in_driven holds the data lines that are currently driven as output.
+ */
+static char *desc_chip = "pinctrl-bcm2835";
+static struct platform_device *desc_pdev;
+static struct gpiod_lookup_table *desc_lookup;
+static struct gpio_descs *desc_out;
+static struct gpio_descs *desc_in;
+static unsigned long desc_out_values;
+static unsigned int desc_out_bits[DESC_OUTPUTS];
+static unsigned int desc_in_bits[DESC_INPUTS];
+static unsigned int desc_in_driven;
+
+/**
+ * Set all GPIOs in a bit mask to the same value. The output array is written with one batched call.
+ *
+ * @param g_bit GPIOs
+ * @param value Value to set
+ */
+static void desc_write(unsigned int g_bit, int value) {
+	bool changed = false;
+	unsigned int i;
+
+	for (i = 0; i < DESC_OUTPUTS; i++) {
+		if (g_bit & desc_out_bits[i]) {
+			__assign_bit(i, &desc_out_values, value);
+			changed = true;
+		}
+	}
+
+	if (changed) {
+		gpiod_set_array_value_cansleep(desc_out->ndescs, desc_out->desc, desc_out->info, &desc_out_values);
+	}
+
+	// Data lines driven as output, only while probing for a SNES Multitap
+	for (i = 0; i < DESC_INPUTS; i++) {
+		if (g_bit & desc_in_bits[i] & desc_in_driven) {
+			gpiod_set_value_cansleep(desc_in->desc[i], value);
+		}
+	}
+}
+
+/**
+ * Set GPIO high.
+ *
+ * @param g_bit GPIO
+ */
+static void desc_set(unsigned int g_bit) {
+	desc_write(g_bit, 1);
+}
+
+/**
+ * Set GPIO low.
+ *
+ * @param g_bit GPIO
+ */
+static void desc_clear(unsigned int g_bit) {
+	desc_write(g_bit, 0);
+}
+
+/**
+ * Set GPIO as input. Only the data lines can change direction, the output array always drives its lines.
+ *
+ * @param g_bit GPIO
+ */
+static void desc_input(unsigned int g_bit) {
+	unsigned int i;
+
+	for (i = 0; i < DESC_INPUTS; i++) {
+		if (g_bit & desc_in_bits[i]) {
+			gpiod_direction_input(desc_in->desc[i]);
+			desc_in_driven &= ~desc_in_bits[i];
+		}
+	}
+}
+
+/**
+ * Set GPIO as output. The GPIO starts out high. Only the data lines can change direction.
+ *
+ * @param g_bit GPIO
+ */
+static void desc_output(unsigned int g_bit) {
+	unsigned int i;
+
+	for (i = 0; i < DESC_INPUTS; i++) {
+		if (g_bit & desc_in_bits[i]) {
+			gpiod_direction_output(desc_in->desc[i], 1);
+			desc_in_driven |= desc_in_bits[i];
+		}
+	}
+}
+
+/**
+ * Pull-ups are part of the board configuration when using gpiod, e.g. gpio=2,3,4=ip,pu in config.txt
+ * on a Raspberry Pi or the pull attribute of a gpio-sim line.
+ *
+ * @param g_bit GPIO
+ */
+static void desc_enable_pull_up(unsigned int g_bit) {
+}
+
+/**
+ * Read all data lines with one batched call. Other GPIOs are returned high.
+ *
+ * @return Status of all GPIOs
+ */
+static unsigned int desc_read(void) {
+	unsigned long values = 0;
+	unsigned int level = ~0;
+	unsigned int i;
+
+	gpiod_get_array_value_cansleep(desc_in->ndescs, desc_in->desc, desc_in->info, &values);
+
+	for (i = 0; i < DESC_INPUTS; i++) {
+		if (!test_bit(i, &values)) {
+			level &= ~desc_in_bits[i];
+		}
+	}
+	return level;
+}
+
+/**
+ * Release the GPIOs, the device and the lookup table.
+ */
+static void desc_exit(void) {
+	if (desc_in) {
+		gpiod_put_array(desc_in);
+		desc_in = NULL;
+	}
+	if (desc_out) {
+		gpiod_put_array(desc_out);
+		desc_out = NULL;
+	}
+	if (desc_pdev) {
+		platform_device_unregister(desc_pdev);
+		desc_pdev = NULL;
+	}
+	if (desc_lookup) {
+		gpiod_remove_lookup_table(desc_lookup);
+		kfree(desc_lookup);
+		desc_lookup = NULL;
+	}
+}
+
+/**
+ * Add a GPIO to the lookup table.
+ *
+ * @param n Index in the lookup table
+ * @param g_bit GPIO bit, the line of desc_chip with the same number is used
+ * @param con_id Name of the array
+ * @param idx Index in the array
+ */
+static void desc_lookup_add(unsigned int n, unsigned int g_bit, const char *con_id, unsigned int idx) {
+	struct gpiod_lookup entry = GPIO_LOOKUP_IDX(desc_chip, __ffs(g_bit), con_id, idx, GPIO_ACTIVE_HIGH);
+
+	desc_lookup->table[n] = entry;
+}
+
+/**
+ * Get one array of GPIO descriptors.
+ *
+ * @param con_id Name of the array in the lookup table
+ * @param flags Direction and initial value of the GPIOs
+ * @param descs Where to store the array
+ * @return Result of the operation
+ */
+static int desc_get(const char *con_id, enum gpiod_flags flags, struct gpio_descs **descs) {
+	struct gpio_descs *array = gpiod_get_array(&desc_pdev->dev, con_id, flags);
+
+	if (IS_ERR(array)) {
+		pr_err("Could not get the %s GPIOs from %s\n", con_id, desc_chip);
+		return PTR_ERR(array);
+	}
+	*descs = array;
+	return 0;
+}
+
+/**
+ * Request the GPIOs as descriptor arrays.
+ *
+ * @param g_bits GPIO bits <clk, latch, port1_d0, port2_d0, port2_d1, port2_pp>
+ * @return Result of the init operation
+ */
+static int desc_init(const unsigned int *g_bits) {
+	static const unsigned char out_index[DESC_OUTPUTS] = { 0, 1, 5 };
+	static const unsigned char in_index[DESC_INPUTS] = { 2, 3, 4 };
+	unsigned int i;
+	int status;
+
+	// One entry per GPIO and an empty entry that ends the table
+	desc_lookup = kzalloc(struct_size(desc_lookup, table, DESC_OUTPUTS + DESC_INPUTS + 1), GFP_KERNEL);
+	if (!desc_lookup) {
+		return -ENOMEM;
+	}
+	desc_lookup->dev_id = KBUILD_MODNAME;
+	for (i = 0; i < DESC_OUTPUTS; i++) {
+		desc_out_bits[i] = g_bits[out_index[i]];
+		desc_lookup_add(i, desc_out_bits[i], "out", i);
+	}
+	for (i = 0; i < DESC_INPUTS; i++) {
+		desc_in_bits[i] = g_bits[in_index[i]];
+		desc_lookup_add(DESC_OUTPUTS + i, desc_in_bits[i], "in", i);
+	}
+	gpiod_add_lookup_table(desc_lookup);
+
+	// The device that the GPIOs are requested for, matched by name in the lookup table
+	desc_pdev = platform_device_register_simple(KBUILD_MODNAME, PLATFORM_DEVID_NONE, NULL, 0);
+	if (IS_ERR(desc_pdev)) {
+		status = PTR_ERR(desc_pdev);
+		desc_pdev = NULL;
+		desc_exit();
+		return status;
+	}
+
+	status = desc_get("out", GPIOD_OUT_HIGH, &desc_out);
+	if (status == 0) {
+		status = desc_get("in", GPIOD_IN, &desc_in);
+	}
+	if (status != 0) {
+		desc_exit();
+		return status;
+	}
+
+	desc_out_values = BIT(DESC_OUTPUTS) - 1;
+	desc_in_driven = 0;
+
+	// The SNES Multitap probe changes the direction of port2_d0. gpiolib only allows get and set
+	// from atomic context, so always capture from process context.
+	gpio_sleeps = true;
+	return 0;
+}
+
+static const struct gpio_backend backend_gpiod = {
+	.name = "gpiod",
+	.init = desc_init,
+	.exit = desc_exit,
+	.set = desc_set,
+	.clear = desc_clear,
+	.input = desc_input,
+	.output = desc_output,
+	.enable_pull_up = desc_enable_pull_up,
+	.read = desc_read,
+};
+
+static const struct gpio_backend *gpio_backends[] = { &backend_raw, &backend_sim, &backend_replay, &backend_gpiod };
+
+#else
+
+static const struct gpio_backend *gpio_backends[] = { &backend_raw, &backend_sim, &backend_replay };
+
+#endif
+
+// The backend used for GPIO access. Known at compile time in a fixed wiring build so the calls are direct.
+#ifdef SNESCON_FIXED
+#define GPIO_BACKEND_(source) (&backend_##source)
+#define GPIO_BACKEND(source) GPIO_BACKEND_(source)
+#define gpio_ops GPIO_BACKEND(SNESCON_FIXED_SOURCE)
+#else
+#define gpio_ops gpio_backend
+#endif
+
+/**
+ * Set GPIO high.
+ *
+ * @param g_bit GPIO
+ */
+static void gpio_set(unsigned int g_bit) {
+	gpio_ops->set(g_bit);
+}
+
+/**
+ * Set GPIO low.
+ *
+ * @param g_bit GPIO
+ */
+static void gpio_clear(unsigned int g_bit) {
+	gpio_ops->clear(g_bit);
+}
+
+/**
+ * Set GPIO as input
+ *
+ * @param g_bit GPIO
+ */
+static void gpio_input(unsigned int g_bit) {
+	gpio_ops->input(g_bit);
+}
+
+/**
+ * Set GPIO as output.
+ *
+ * @param g_bit GPIO
+ */
+static void gpio_output(unsigned int g_bit) {
+	gpio_ops->output(g_bit);
+}
+
+/**
+ * Activate internal pull-up.
+ * 
+ * @param g_bit GPIO
+ */
+static void gpio_enable_pull_up(unsigned int g_bit) {
+	gpio_ops->enable_pull_up(g_bit);
+}
+
 /**
  * Read status of GPIO.
  *
@@ -116,7 +704,7 @@ static void gpio_enable_pull_up(unsigned int g_bit) {
  * @return Status of GPIO
  */
 static unsigned char gpio_read(unsigned int g_bit) {
-	return g_bit & *(gpio + 13);
+	return g_bit & gpio_ops->read();
 }
 
 /**
@@ -125,29 +713,55 @@ static unsigned char gpio_read(unsigned int g_bit) {
  * @return Negated status of all GPIOs
  */
 static unsigned int gpio_read_all(void) {
-	return ~(*(gpio + 13));;
+	return ~gpio_ops->read();
 }
 
 /**
  * Init function for the gpio part of the driver.
  *
+ * @param source Name of the GPIO backend to use
+ * @param g_bits GPIO bits <clk, latch, port1_d0, port2_d0, port2_d1, port2_pp>
  * @return Result of the init operation
  */
-static int __init gpio_init(void) {
-	// Set up gpio pointer for direct register access.
-	if ((gpio = ioremap(GPIO_BASE, 0xB0)) == NULL) {
-		pr_err("io remap failed\n");
-		return -EBUSY;
+static int __init gpio_init(const char *source, const unsigned int *g_bits) {
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gpio_backends); i++) {
+		if (strcmp(source, gpio_backends[i]->name) == 0) {
+			gpio_backend = gpio_backends[i];
+			break;
+		}
 	}
 
-	return 0;
+	if (!gpio_backend) {
+		pr_err("Unknown GPIO source %s\n", source);
+		return -EINVAL;
+	}
+
+#ifdef SNESCON_FIXED
+	if (gpio_backend != gpio_ops) {
+		pr_err("Built for source=%s only\n", gpio_ops->name);
+		return -EINVAL;
+	}
+#endif
+
+	return gpio_backend->init(g_bits);
+}
+
+/**
+ * Check if the GPIOs may only be accessed from a context that can sleep.
+ *
+ * @return true if the GPIO access can sleep
+ */
+static bool gpio_backend_sleeps(void) {
+	return gpio_sleeps;
 }
 
 /**
  * Exit function for the gpio part of the driver.
  */
 static void gpio_exit(void) {
-	iounmap(gpio);
+	gpio_backend->exit();
 }
 
 /**
@@ -211,6 +825,39 @@ static unsigned int gpio_get_bit(unsigned char g_id) {
 #define BITS_LENGTH 24
 #define NUMBER_OF_GPIOS 6
 #define NUMBER_OF_INPUT_DEVICES 5
+#define NUMBER_OF_BUTTONS 8
+#define PAD_KEYMAP_SIZE 12
+#define NUMBER_OF_PORTS 2
+#define NUMBER_OF_DATA_LINES 3
+#define SIGNATURE_START 16
+#define DEAD_PORT_PROBE_INTERVAL 25
+
+/*
+ * How the d-pad is reported.
+ * DPAD_AXES: ABS_X and ABS_Y.
+ * DPAD_BUTTONS: BTN_DPAD_UP, BTN_DPAD_DOWN, BTN_DPAD_LEFT and BTN_DPAD_RIGHT. These are part of the keymap.
+ * DPAD_HAT: ABS_HAT0X and ABS_HAT0Y.
+ */
+#define DPAD_AXES 0
+#define DPAD_BUTTONS 1
+#define DPAD_HAT 2
+
+/*
+ * Link status of a port in one frame.
+ * PORT_OK: Something answered and the bits after the buttons hold the expected signature.
+ * PORT_INVALID: Something answered but the signature is wrong. Bad cable or unknown device.
+ * PORT_DISCONNECTED: The data line read high (all ones) for the whole frame.
+ */
+#define PORT_OK 0
+#define PORT_INVALID 1
+#define PORT_DISCONNECTED 2
+
+/*
+ * Accessory detected on a port.
+ */
+#define ACCESSORY_NONE 0
+#define ACCESSORY_MULTITAP 1
+#define ACCESSORY_FOURSCORE 2
 
 /*
  * Structure that contain the configuration.
@@ -222,10 +869,35 @@ static unsigned int gpio_get_bit(unsigned char g_id) {
  * multitap_enabled and fourscore_enabled are redable and writable from userspace (sysfs parameter).
  * There are no message to the driver when the variable are written. So they need to be handled as they can change at any time.
  *
+ * keycode holds one keymap per pad, keymap_size entries each. The keymaps are handed to the input core
+ * so they can be read and changed with EVIOCGKEYCODE/EVIOCSKEYCODE. The d-pad entries are only part of
+ * the keymap when dpad_mode is DPAD_BUTTONS.
+ *
+ * When aggregate is set all pads are reported through pad[0] only. Each player then has its own range of
+ * buttons (BTN_TRIGGER_HAPPY1 + 8 * player) and axes (ABS_X/ABS_Y + 2 * player), the keymap of pad[0]
+ * covers all players and there is one input_sync() per update.
+ *
+ * frames, invalid_frames, disconnected_frames and accessory_changes are link health counters per port
+ * <port 1, port 2>, readable from userspace (sysfs parameter). A port that has been disconnected for more
+ * than dead_frames frames in a row is dead. Its pads are no longer reported until it answers again. With
+ * dead_skip_scan set, dead ports are only clocked every DEAD_PORT_PROBE_INTERVAL update.
  */
 struct pads_config {
 	unsigned int gpio[NUMBER_OF_GPIOS];
 	struct input_dev *pad[NUMBER_OF_INPUT_DEVICES];
+	unsigned short keycode[NUMBER_OF_INPUT_DEVICES * PAD_KEYMAP_SIZE];
+	unsigned char keymap_size;
+	unsigned int dpad_mode;
+	bool aggregate;
+	unsigned int frames[NUMBER_OF_PORTS];
+	unsigned int invalid_frames[NUMBER_OF_PORTS];
+	unsigned int disconnected_frames[NUMBER_OF_PORTS];
+	unsigned int accessory_changes[NUMBER_OF_PORTS];
+	unsigned int dead_cnt[NUMBER_OF_PORTS];
+	unsigned char accessory[NUMBER_OF_PORTS];
+	unsigned int dead_frames;
+	bool dead_skip_scan;
+	unsigned int probe_cnt;
 	unsigned char player_mode;
 	char *device_name;
 	int (* open) (struct input_dev *dev);
@@ -234,11 +906,42 @@ struct pads_config {
 	bool fourscore_enabled;
 };
 
-// Buttons found on the SNES gamepad
-static const long btn_label[] = { BTN_B, BTN_Y, BTN_SELECT, BTN_START, BTN_A, BTN_X, BTN_TL, BTN_TR };
+/*
+ * Access to the wiring and the enabled accessories. Constants in a fixed wiring build.
+ */
+#ifdef SNESCON_FIXED
+static const unsigned char fixed_gpio_id[NUMBER_OF_GPIOS] = { SNESCON_FIXED_GPIO };
+#define PADS_GPIO(cfg, n) (1U << fixed_gpio_id[n])
+#define PADS_MULTITAP(cfg) (SNESCON_FIXED_MULTITAP)
+#define PADS_FOURSCORE(cfg) (SNESCON_FIXED_FOURSCORE)
+#else
+#define PADS_GPIO(cfg, n) ((cfg)->gpio[n])
+#define PADS_MULTITAP(cfg) ((cfg)->multitap_enabled)
+#define PADS_FOURSCORE(cfg) ((cfg)->fourscore_enabled)
+#endif
+
+/*
+ * One frame captured from the data lines, packed per line. This is also the record format of /dev/snescon_gpio_rpi.
+ *
+ * time: Capture time in ns (CLOCK_MONOTONIC).
+ * line: <port1_d0, port2_d0, port2_d1>. Bit n is bit n of the frame read from the line. A set bit means the line was low.
+ * multitap: 1 when the frame was read with the SNES Multitap protocol, otherwise 0.
+ */
+struct pads_frame {
+	u64 time;
+	u64 line[NUMBER_OF_DATA_LINES];
+	u8 multitap;
+	u8 reserved[7];
+};
+
+// Default keymap of the SNES gamepad. Buttons followed by the d-pad <up, down, left, right>.
+static const unsigned short btn_label[PAD_KEYMAP_SIZE] = {
+	BTN_B, BTN_Y, BTN_SELECT, BTN_START, BTN_A, BTN_X, BTN_TL, BTN_TR,
+	BTN_DPAD_UP, BTN_DPAD_DOWN, BTN_DPAD_LEFT, BTN_DPAD_RIGHT
+};
 
-// The order that the buttons of the SNES gamepad are stored in the byte string
-static const unsigned char btn_index[] = { 0, 1, 2, 3, 8, 9, 10, 11 };
+// The order that the buttons and the d-pad of the SNES gamepad are stored in the byte string
+static const unsigned char btn_index[PAD_KEYMAP_SIZE] = { 0, 1, 2, 3, 8, 9, 10, 11, 4, 5, 6, 7 };
 
 /**
  * Read the data pins of all connected devices.
@@ -250,8 +953,8 @@ static void pads_read(struct pads_config *cfg, unsigned int *data) {
 	int i;
 	unsigned int clk, latch;
 
-	clk = cfg->gpio[0];
-	latch = cfg->gpio[1];
+	clk = PADS_GPIO(cfg, 0);
+	latch = PADS_GPIO(cfg, 1);
 
 	gpio_set(clk | latch);
 	udelay(DELAY * 2);
@@ -276,9 +979,9 @@ static void pads_read_multitap(struct pads_config *cfg, unsigned int *data) {
 	int i;
 	unsigned int clk, latch, pp;
 
-	clk = cfg->gpio[0];
-	latch = cfg->gpio[1];
-	pp = cfg->gpio[5];
+	clk = PADS_GPIO(cfg, 0);
+	latch = PADS_GPIO(cfg, 1);
+	pp = PADS_GPIO(cfg, 5);
 
 	gpio_set(clk | latch);
 	udelay(DELAY * 2);
@@ -319,10 +1022,10 @@ static unsigned char multitap_connected(struct pads_config *cfg) {
 	unsigned int clk, latch, d0, d1;
 
 	// Store GPIOs in variables
-	clk = cfg->gpio[0];
-	latch = cfg->gpio[1];
-	d0 = cfg->gpio[3];
-	d1 = cfg->gpio[4];
+	clk = PADS_GPIO(cfg, 0);
+	latch = PADS_GPIO(cfg, 1);
+	d0 = PADS_GPIO(cfg, 3);
+	d1 = PADS_GPIO(cfg, 4);
 
 	// Set D0 to output
 	gpio_input(d0);
@@ -375,26 +1078,169 @@ static unsigned char multitap_connected(struct pads_config *cfg) {
 /**
  * Check if a NES Four Score is connected.
  *
- * @param cfg The pad configuration
+ * The Four Score signature is found in bit 16-23: 0x08 on port 1 and 0x04 on port 2.
+ *
+ * @param frame The captured frame
  * @return 1 if a NES Four Score is connected, otherwise 0
  */
-static unsigned char fourscore_connected(struct pads_config *cfg, unsigned int *data) {
-	return !(cfg->gpio[2] & data[16]) &&
-	       !(cfg->gpio[2] & data[17]) &&
-	       !(cfg->gpio[2] & data[18]) &&
-	        (cfg->gpio[2] & data[19]) &&
-	       !(cfg->gpio[2] & data[20]) &&
-	       !(cfg->gpio[2] & data[21]) &&
-	       !(cfg->gpio[2] & data[22]) &&
-	       !(cfg->gpio[2] & data[23]) &&
-	       !(cfg->gpio[3] & data[16]) &&
-	       !(cfg->gpio[3] & data[17]) &&
-	        (cfg->gpio[3] & data[18]) &&
-	       !(cfg->gpio[3] & data[19]) &&
-	       !(cfg->gpio[3] & data[20]) &&
-	       !(cfg->gpio[3] & data[21]) &&
-	       !(cfg->gpio[3] & data[22]) &&
-	       !(cfg->gpio[3] & data[23]);
+static unsigned char fourscore_connected(const struct pads_frame *frame) {
+	return ((frame->line[0] >> SIGNATURE_START) & 0xFF) == 0x08 &&
+	       ((frame->line[1] >> SIGNATURE_START) & 0xFF) == 0x04;
+}
+
+/**
+ * Check the link status of a port.
+ *
+ * @param line The captured bits of the data line of the port
+ * @param len Number of bits read
+ * @return PORT_OK, PORT_INVALID or PORT_DISCONNECTED
+ */
+static unsigned char port_status(u64 line, unsigned char len) {
+	const u64 all = (1ULL << len) - 1;
+	const u64 signature = all & ~((1ULL << SIGNATURE_START) - 1);
+
+	// A connected pad pulls the data line low for every bit after the buttons
+	if (!(line & all)) {
+		return PORT_DISCONNECTED;
+	}
+	return (line & signature) == signature ? PORT_OK : PORT_INVALID;
+}
+
+/**
+ * Check if a port is dead.
+ *
+ * @param cfg The pad configuration
+ * @param port Index of the port
+ * @return true if the port has been disconnected for more than dead_frames frames
+ */
+static bool port_dead(struct pads_config *cfg, unsigned char port) {
+	return cfg->dead_frames && cfg->dead_cnt[port] > cfg->dead_frames;
+}
+
+/**
+ * Update the link health counters of a port with a new frame.
+ *
+ * @param cfg The pad configuration
+ * @param port Index of the port
+ * @param status Link status of the port in the frame
+ * @param accessory Accessory detected on the port in the frame
+ */
+static void port_update(struct pads_config *cfg, unsigned char port, unsigned char status, unsigned char accessory) {
+	cfg->frames[port]++;
+
+	if (status == PORT_DISCONNECTED) {
+		cfg->disconnected_frames[port]++;
+		if (!port_dead(cfg, port)) {
+			cfg->dead_cnt[port]++;
+		}
+	} else {
+		if (port_dead(cfg, port)) {
+			pr_info("Port %u is back\n", port + 1);
+		}
+		cfg->dead_cnt[port] = 0;
+		if (status == PORT_INVALID) {
+			cfg->invalid_frames[port]++;
+		}
+	}
+
+	if (accessory != cfg->accessory[port]) {
+		cfg->accessory[port] = accessory;
+		cfg->accessory_changes[port]++;
+	}
+}
+
+/**
+ * Get the number of input devices in use.
+ *
+ * @param cfg The pad configuration
+ * @return Number of input devices
+ */
+static unsigned char pads_devices(struct pads_config *cfg) {
+	return cfg->aggregate ? 1 : NUMBER_OF_INPUT_DEVICES;
+}
+
+/**
+ * Get the input device that a pad is reported through.
+ *
+ * @param cfg The pad configuration
+ * @param player Index of the pad
+ * @return The input device
+ */
+static struct input_dev *pads_dev(struct pads_config *cfg, unsigned char player) {
+	return cfg->pad[cfg->aggregate ? 0 : player];
+}
+
+/**
+ * Get the X axis that the d-pad of a pad is reported on. The Y axis follows directly after.
+ *
+ * @param cfg The pad configuration
+ * @param player Index of the pad
+ * @return The X axis
+ */
+static unsigned int pads_abs_x(struct pads_config *cfg, unsigned char player) {
+	if (cfg->aggregate) {
+		return ABS_X + 2 * player;
+	}
+	return (cfg->dpad_mode == DPAD_HAT) ? ABS_HAT0X : ABS_X;
+}
+
+/**
+ * Report the status of the d-pad of one pad.
+ *
+ * @param cfg The pad configuration
+ * @param player Index of the pad
+ * @param keys The keymap of the pad
+ * @param up, down, left, right Status of each direction of the d-pad, non zero when pressed
+ */
+static void pads_report_dpad(struct pads_config *cfg, unsigned char player, const unsigned short *keys,
+		unsigned int up, unsigned int down, unsigned int left, unsigned int right) {
+	struct input_dev *dev = pads_dev(cfg, player);
+	unsigned int abs_x;
+
+	if (cfg->dpad_mode == DPAD_BUTTONS) {
+		input_report_key(dev, keys[NUMBER_OF_BUTTONS], up);
+		input_report_key(dev, keys[NUMBER_OF_BUTTONS + 1], down);
+		input_report_key(dev, keys[NUMBER_OF_BUTTONS + 2], left);
+		input_report_key(dev, keys[NUMBER_OF_BUTTONS + 3], right);
+	} else {
+		abs_x = pads_abs_x(cfg, player);
+		input_report_abs(dev, abs_x, !left - !right);
+		input_report_abs(dev, abs_x + 1, !up - !down);
+	}
+}
+
+/**
+ * Report the status of one pad.
+ *
+ * @param cfg The pad configuration
+ * @param player Index of the pad
+ * @param frame The captured frame
+ * @param line Index of the data line the pad is read from. Line 0 is port 1, the others port 2.
+ * @param offset Index in the line of the first bit of the pad
+ * @param n_btns Number of buttons on the pad. 4 for NES and 8 for SNES.
+ */
+static void pads_report(struct pads_config *cfg, unsigned char player, const struct pads_frame *frame,
+		unsigned char line, unsigned char offset, unsigned char n_btns) {
+	struct input_dev *dev = pads_dev(cfg, player);
+	const unsigned short *keys = &cfg->keycode[player * cfg->keymap_size];
+	const unsigned char *dpad = &btn_index[NUMBER_OF_BUTTONS];
+	const u64 bits = frame->line[line] >> offset;
+	unsigned char j;
+
+	// Pads on a dead port were released by the last frame before it died
+	if (port_dead(cfg, line ? 1 : 0)) {
+		return;
+	}
+
+	for (j = 0; j < n_btns; j++) {
+		input_report_key(dev, keys[j], (bits >> btn_index[j]) & 1);
+	}
+	pads_report_dpad(cfg, player, keys,
+			(bits >> dpad[0]) & 1, (bits >> dpad[1]) & 1,
+			(bits >> dpad[2]) & 1, (bits >> dpad[3]) & 1);
+	if (!cfg->aggregate) {
+		input_sync(dev);
+	}
 }
 
 /**
@@ -405,152 +1251,150 @@ static unsigned char fourscore_connected(struct pads_config *cfg, unsigned int *
  */
 static void pads_clear(struct pads_config *cfg, unsigned char n_devs) {
 	struct input_dev *dev;
+	const unsigned short *keys;
+	unsigned char player;
 	int i, j;
 	for(i = 0; i < n_devs; i++) {
-		dev = cfg->pad[(NUMBER_OF_INPUT_DEVICES - 1) - i];
-		for (j = 0; j < 8; j++) {
-			input_report_key(dev, btn_label[j], 0);
+		player = (NUMBER_OF_INPUT_DEVICES - 1) - i;
+		dev = pads_dev(cfg, player);
+		keys = &cfg->keycode[player * cfg->keymap_size];
+		for (j = 0; j < NUMBER_OF_BUTTONS; j++) {
+			input_report_key(dev, keys[j], 0);
+		}
+		pads_report_dpad(cfg, player, keys, 0, 0, 0, 0);
+		if (!cfg->aggregate) {
+			input_sync(dev);
+		}
+	}
+}
+
+/**
+ * Pack the bits of one data line.
+ *
+ * @param data The read data
+ * @param g GPIO bit of the data line
+ * @param len Number of bits read
+ * @return Bit n is set if the data line was low in bit n
+ */
+static inline u64 pads_pack(const unsigned int *data, unsigned int g, unsigned char len) {
+	u64 line = 0;
+	unsigned char i;
+
+	for (i = 0; i < len; i++) {
+		if (g & data[i]) {
+			line |= 1ULL << i;
 		}
-		input_report_abs(dev, ABS_X, 0);
-		input_report_abs(dev, ABS_Y, 0);
-		input_sync(dev);
 	}
+	return line;
 }
 
 /**
- * Update the status of all connected devices.
+ * Capture one frame from all connected devices.
+ *
+ * This is the time critical part of an update. It only clocks the devices and packs the read bits per
+ * data line. Decoding and reporting is left to pads_decode().
  *
  * @param cfg The pad configuration
+ * @param frame The frame to fill in
+ * @return 1 if a frame was captured, 0 if all ports are dead and were not clocked this time
  */
-static void pads_update(struct pads_config *cfg) {
-	unsigned int g, data[BUFFER_SIZE];
-	unsigned char i, j;
-	struct input_dev *dev;
+static unsigned char pads_capture(struct pads_config *cfg, struct pads_frame *frame) {
+	unsigned int data[BUFFER_SIZE];
+	unsigned char len;
+	bool probe;
+
+	// Dead ports are only clocked now and then to see if they are back
+	probe = !cfg->dead_skip_scan || (++cfg->probe_cnt % DEAD_PORT_PROBE_INTERVAL) == 0;
+	if (!probe && port_dead(cfg, 0) && port_dead(cfg, 1)) {
+		return 0;
+	}
 
-	if (cfg->multitap_enabled && multitap_connected(cfg)) {
-		// SNES Multitap
+	frame->multitap = PADS_MULTITAP(cfg) && (probe || !port_dead(cfg, 1)) && multitap_connected(cfg);
+	if (frame->multitap) {
 		pads_read_multitap(cfg, data);
+		len = BITS_LENGTH_MULTITAP;
+	} else {
+		pads_read(cfg, data);
+		len = BITS_LENGTH;
+	}
+
+	// Pack the bits of every data line
+	frame->line[0] = pads_pack(data, PADS_GPIO(cfg, 2), len);
+	frame->line[1] = pads_pack(data, PADS_GPIO(cfg, 3), len);
+	frame->line[2] = pads_pack(data, PADS_GPIO(cfg, 4), len);
+
+	return 1;
+}
+
+/**
+ * Decode a captured frame and update the status of all connected devices.
+ *
+ * @param cfg The pad configuration
+ * @param frame The captured frame
+ */
+static void pads_decode(struct pads_config *cfg, const struct pads_frame *frame) {
+	unsigned char i;
+
+	if (PADS_MULTITAP(cfg) && frame->multitap) {
+		// SNES Multitap
+		port_update(cfg, 0, port_status(frame->line[0], BITS_LENGTH_MULTITAP), ACCESSORY_NONE);
+		port_update(cfg, 1, PORT_OK, ACCESSORY_MULTITAP);
 		
 		// Set 5 player mode
 		cfg->player_mode = 5;
 
-		// Player 1
-		dev = cfg->pad[0];
-		g = cfg->gpio[2];
-
-		for (j = 0; j < 8; j++) {
-			input_report_key(dev, btn_label[j], g & data[btn_index[j]]);
+		// Player 1, 2 and 3
+		for (i = 0; i < 3; i++) {
+			pads_report(cfg, i, frame, i, 0, NUMBER_OF_BUTTONS);
 		}
-		input_report_abs(dev, ABS_X, !(g & data[6]) - !(g & data[7]));
-		input_report_abs(dev, ABS_Y, !(g & data[4]) - !(g & data[5]));
-		input_sync(dev);
-
-		// Player 2
-		dev = cfg->pad[1];
-		g = cfg->gpio[3];
 
-		for (j = 0; j < 8; j++) {
-			input_report_key(dev, btn_label[j], g & data[btn_index[j]]);
-		}
-		input_report_abs(dev, ABS_X, !(g & data[6]) - !(g & data[7]));
-		input_report_abs(dev, ABS_Y, !(g & data[4]) - !(g & data[5]));
-		input_sync(dev);
+		// Player 4 and 5
+		pads_report(cfg, 3, frame, 1, 17, NUMBER_OF_BUTTONS);
+		pads_report(cfg, 4, frame, 2, 17, NUMBER_OF_BUTTONS);
 
-		// Player 3
-		dev = cfg->pad[2];
-		g = cfg->gpio[4];
+	} else if (PADS_FOURSCORE(cfg) && fourscore_connected(frame)) {
+		// NES Four Score
+		port_update(cfg, 0, PORT_OK, ACCESSORY_FOURSCORE);
+		port_update(cfg, 1, PORT_OK, ACCESSORY_FOURSCORE);
 
-		for (j = 0; j < 8; j++) {
-			input_report_key(dev, btn_label[j], g & data[btn_index[j]]);
+		// Player 1 and 2
+		for (i = 0; i < 2; i++) {
+			pads_report(cfg, i, frame, i, 0, 4);
 		}
-		input_report_abs(dev, ABS_X, !(g & data[6]) - !(g & data[7]));
-		input_report_abs(dev, ABS_Y, !(g & data[4]) - !(g & data[5]));
-		input_sync(dev);
-
-		// Player 4
-		dev = cfg->pad[3];
-		g = cfg->gpio[3];
 
-		for (j = 0; j < 8; j++) {
-			input_report_key(dev, btn_label[j], g & data[btn_index[j] + 17]);
+		// Player 3 and 4
+		for (i = 2; i < 4; i++) {
+			pads_report(cfg, i, frame, i - 2, 8, 4);
 		}
-		input_report_abs(dev, ABS_X, !(g & data[23]) - !(g & data[24]));
-		input_report_abs(dev, ABS_Y, !(g & data[21]) - !(g & data[22]));
-		input_sync(dev);
-
-		// Player 5
-		dev = cfg->pad[4];
-		g = cfg->gpio[4];
+		
+		// Check if virtual device 5 should be cleared and if player_mode should be changed to 4 player mode
+		if (cfg->player_mode > 4) {
+			cfg->player_mode = 4;
+			pads_clear(cfg, 1);
+		} else if (cfg->player_mode < 4) {
+			cfg->player_mode = 4;
+		}
+	} else {
+		// NES or SNES gamepad
+		port_update(cfg, 0, port_status(frame->line[0], BITS_LENGTH), ACCESSORY_NONE);
+		port_update(cfg, 1, port_status(frame->line[1], BITS_LENGTH), ACCESSORY_NONE);
 
-		for (j = 0; j < 8; j++) {
-			input_report_key(dev, btn_label[j], g & data[btn_index[j] + 17]);
+		// Player 1 and 2
+		for (i = 0; i < 2; i++) {
+			pads_report(cfg, i, frame, i, 0, NUMBER_OF_BUTTONS);
 		}
-		input_report_abs(dev, ABS_X, !(g & data[23]) - !(g & data[24]));
-		input_report_abs(dev, ABS_Y, !(g & data[21]) - !(g & data[22]));
-		input_sync(dev);
 
-	} else {
-		pads_read(cfg, data);
-	
-		if (cfg->fourscore_enabled && fourscore_connected(cfg, data)) {
-			// NES Four Score
-	
-			// Player 1 and 2
-			for (i = 0; i < 2; i++) {
-				dev = cfg->pad[i];
-				g = cfg->gpio[i + 2];
-	
-				for (j = 0; j < 4; j++) {
-					input_report_key(dev, btn_label[j], g & data[btn_index[j]]);
-				}
-				input_report_abs(dev, ABS_X, !(g & data[6]) - !(g & data[7]));
-				input_report_abs(dev, ABS_Y, !(g & data[4]) - !(g & data[5]));
-				input_sync(dev);
-			}
-	
-			// Player 3 and 4
-			for (i = 2; i < 4; i++) {
-				dev = cfg->pad[i];
-				g = cfg->gpio[i];
-	
-				for (j = 0; j < 4; j++) {
-					input_report_key(dev, btn_label[j], g & data[btn_index[j] + 8]);
-				}
-				input_report_abs(dev, ABS_X, !(g & data[14]) - !(g & data[15]));
-				input_report_abs(dev, ABS_Y, !(g & data[12]) - !(g & data[13]));
-				input_sync(dev);
-			}
-			
-			// Check if virtual device 5 should be cleared and if player_mode should be changed to 4 player mode
-			if (cfg->player_mode > 4) {
-				cfg->player_mode = 4;
-				pads_clear(cfg, 1);
-			} else if (cfg->player_mode < 4) {
-				cfg->player_mode = 4;
-			}
-		} else {
-			// NES or SNES gamepad
-	
-			// Player 1 and 2
-			for (i = 0; i < 2; i++) {
-				dev = cfg->pad[i];
-				g = cfg->gpio[i + 2];
-	
-				for (j = 0; j < 8; j++) {
-					input_report_key(dev, btn_label[j], g & data[btn_index[j]]);
-				}
-				input_report_abs(dev, ABS_X, !(g & data[6]) - !(g & data[7]));
-				input_report_abs(dev, ABS_Y, !(g & data[4]) - !(g & data[5]));
-				input_sync(dev);
-			}
-	
-			// Check if virtual devices 3, 4 and 5 should be cleared and player_mode should be changed to 2 player mode
-			if (cfg->player_mode > 2) {
-				cfg->player_mode = 2;
-				pads_clear(cfg, 3);
-			}
+		// Check if virtual devices 3, 4 and 5 should be cleared and player_mode should be changed to 2 player mode
+		if (cfg->player_mode > 2) {
+			cfg->player_mode = 2;
+			pads_clear(cfg, 3);
 		}
 	}
+
+	// All players share one input device. Sync it once for the whole update.
+	if (cfg->aggregate) {
+		input_sync(cfg->pad[0]);
+	}
 }
 
 /**
@@ -563,19 +1407,19 @@ static void __init pads_setup_gpio(struct pads_config *cfg) {
 
 	// Setup GPIO for clk and latch
 	for(i = 0; i < 2; i++) {
-		bit = cfg->gpio[i];
+		bit = PADS_GPIO(cfg, i);
 		gpio_output(bit);
 	}
 	
 	// Setup GPIO for port1_d0, port2_d0, port2_d1
 	for(i = 2; i < 5; i++) {
-		bit = cfg->gpio[i];
+		bit = PADS_GPIO(cfg, i);
 		gpio_input(bit);
 		gpio_enable_pull_up(bit);
 	}
 	
 	// Setup GPIO for port1_pp
-	bit = cfg->gpio[5];
+	bit = PADS_GPIO(cfg, 5);
 	gpio_input(bit);
 }
 
@@ -589,7 +1433,15 @@ static int __init pads_setup(struct pads_config *cfg) {
 	int i, j;
 	int status = 0;
 
-	for (i = 0; (i < NUMBER_OF_INPUT_DEVICES) && (0 == status); ++i) {
+	// Fill in the default keymap of every pad. Give each player its own buttons when they share one device.
+	cfg->keymap_size = (cfg->dpad_mode == DPAD_BUTTONS) ? PAD_KEYMAP_SIZE : NUMBER_OF_BUTTONS;
+	for (i = 0; i < NUMBER_OF_INPUT_DEVICES; i++) {
+		for (j = 0; j < cfg->keymap_size; j++) {
+			cfg->keycode[i * cfg->keymap_size + j] = cfg->aggregate ? BTN_TRIGGER_HAPPY1 + i * NUMBER_OF_BUTTONS + j : btn_label[j];
+		}
+	}
+
+	for (i = 0; (i < pads_devices(cfg)) && (0 == status); ++i) {
 		cfg->pad[i] = input_allocate_device();
 		if (!cfg->pad[i]) {
 			pr_err("Not enough memory for input device!\n");
@@ -621,14 +1473,21 @@ static int __init pads_setup(struct pads_config *cfg) {
     
 			cfg->pad[i]->open = cfg->open;
 			cfg->pad[i]->close = cfg->close;
-			cfg->pad[i]->evbit[0] = BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS);
-        
-			for (j = 0; j < 2; j++) {
-				input_set_abs_params(cfg->pad[i], ABS_X + j, -1, 1, 0, 0);
+			cfg->pad[i]->evbit[0] = BIT_MASK(EV_KEY);
+
+			if (cfg->dpad_mode != DPAD_BUTTONS) {
+				cfg->pad[i]->evbit[0] |= BIT_MASK(EV_ABS);
+				for (j = 0; j < 2 * (cfg->aggregate ? NUMBER_OF_INPUT_DEVICES : 1); j++) {
+					input_set_abs_params(cfg->pad[i], pads_abs_x(cfg, i) + j, -1, 1, 0, 0);
+				}
 			}
-            		
-			for (j = 0; j < 8; j++) {
-				__set_bit(btn_label[j], cfg->pad[i]->keybit);
+
+			// Hand the keymap to the input core. EVIOCGKEYCODE/EVIOCSKEYCODE operate on it directly.
+			cfg->pad[i]->keycode = &cfg->keycode[i * cfg->keymap_size];
+			cfg->pad[i]->keycodesize = sizeof(cfg->keycode[0]);
+			cfg->pad[i]->keycodemax = cfg->keymap_size * (cfg->aggregate ? NUMBER_OF_INPUT_DEVICES : 1);
+			for (j = 0; j < cfg->pad[i]->keycodemax; j++) {
+				__set_bit(cfg->keycode[i * cfg->keymap_size + j], cfg->pad[i]->keybit);
 			}
 			
 			status = input_register_device(cfg->pad[i]);
@@ -650,7 +1509,7 @@ static int __init pads_setup(struct pads_config *cfg) {
 	return status;
 }
 
-static void __exit pads_remove(struct pads_config *cfg) {
+static void pads_remove(struct pads_config *cfg) {
 	int idx;
 
 	for (idx = 0; idx < NUMBER_OF_INPUT_DEVICES; idx++) {
@@ -671,7 +1530,10 @@ static void __exit pads_remove(struct pads_config *cfg) {
   |______|_|_| |_|\__,_/_/\_\  |_|\_\___|_|  |_| |_|\___|_|
 */
 
-#define REFRESH_TIME HZ/100
+#define REFRESH_RATE 100
+#define FRAME_QUEUE_SIZE 8
+#define RECORD_QUEUE_SIZE 256
+#define REPLAY_QUEUE_SIZE 64
 
 MODULE_AUTHOR("Christian Isaksson");
 MODULE_AUTHOR("Karl Thoren <karl.h.thoren@gmail.com>");
@@ -681,27 +1543,307 @@ MODULE_VERSION("1.0.0");
 
 /*
  * Structure that contain pads configuration, timer and mutex.
+ *
+ * An update is done in two stages. The timer captures a frame and puts it in the frame queue. The work
+ * decodes the queued frames and reports them to the input core. The queue has one producer and one
+ * consumer and needs no locking.
+ *
+ * /dev/snescon_gpio_rpi (misc) records and replays frames. With record set every decoded frame is also put in the
+ * recorded queue, read by userspace. With source=replay userspace writes frames to the replay queue instead
+ * of capturing them. They are handed to the frame queue by the timer at their original timing when
+ * replay_realtime is set, otherwise the work decodes them directly as fast as possible.
+ * The mutexes serialize the readers and the writers, so every queue still has one producer and one consumer.
+ *
+ * stopping is set when the module is unloaded. The timer and the work are then no longer started by opening
+ * or closing the input devices.
  */
 struct snescon_config {
 	struct pads_config pads_cfg;
 	struct timer_list timer;
+	struct work_struct work;
+	DECLARE_KFIFO(frames, struct pads_frame, FRAME_QUEUE_SIZE);
+	unsigned int dropped_frames;
+	unsigned int capture_ns;
+	struct miscdevice misc;
+	bool record;
+	DECLARE_KFIFO(recorded, struct pads_frame, RECORD_QUEUE_SIZE);
+	unsigned int record_dropped;
+	struct mutex record_mutex;
+	wait_queue_head_t record_wait;
+	bool replay;
+	bool replay_realtime;
+	bool replay_started;
+	u64 replay_offset;
+	DECLARE_KFIFO(replayed, struct pads_frame, REPLAY_QUEUE_SIZE);
+	struct mutex replay_mutex;
+	wait_queue_head_t replay_wait;
 	struct mutex mutex;
 	int driver_usage_cnt;
+	bool stopping;
 	unsigned int gpio_id[NUMBER_OF_GPIOS];
 	unsigned int gpio_id_cnt; // Counter used in communication with userspace. Should be set to NUMBER_OF_GPIOS if parameter gpio_id is valid.
+	char *source;
+	unsigned int refresh_rate;
 };
 
 /**
- * Timer that read and update all pads.
+ * Time until the next update of the pads. Rates above HZ are capped to one update per jiffy.
+ *
+ * @param cfg The pointer to the snescon_config structure
+ * @return Time in jiffies
+ */
+static unsigned long snescon_refresh_time(struct snescon_config *cfg) {
+	unsigned int rate = READ_ONCE(cfg->refresh_rate);
+
+	if (rate == 0 || rate >= HZ) {
+		return 1;
+	}
+	return HZ / rate;
+}
+
+/**
+ * Hand the replayed frames that are due over to the work. The first frame after the replay queue ran
+ * empty is due at once, the following ones at the same distance in time as when they were recorded.
+ *
+ * @param cfg The pointer to the snescon_config structure
+ * @param now Current time in ns
+ */
+static void snescon_replay(struct snescon_config *cfg, u64 now) {
+	struct pads_frame frame;
+
+	while (kfifo_peek(&cfg->replayed, &frame)) {
+		if (!cfg->replay_started) {
+			cfg->replay_offset = now - frame.time;
+			cfg->replay_started = true;
+		}
+		if (frame.time + cfg->replay_offset > now) {
+			break;
+		}
+		kfifo_skip(&cfg->replayed);
+		if (!kfifo_put(&cfg->frames, frame)) {
+			cfg->dropped_frames++;
+		}
+	}
+
+	if (kfifo_is_empty(&cfg->replayed)) {
+		cfg->replay_started = false;
+	}
+	wake_up_interruptible(&cfg->replay_wait);
+}
+
+/**
+ * Decode a frame and record it.
+ *
+ * @param cfg The pointer to the snescon_config structure
+ * @param frame The frame
+ */
+static void snescon_decode(struct snescon_config *cfg, const struct pads_frame *frame) {
+	pads_decode(&(cfg->pads_cfg), frame);
+
+	if (READ_ONCE(cfg->record)) {
+		// The frame is dropped if userspace has fallen behind reading
+		if (kfifo_put(&cfg->recorded, *frame)) {
+			wake_up_interruptible(&cfg->record_wait);
+		} else {
+			cfg->record_dropped++;
+		}
+	}
+}
+
+/**
+ * Capture a frame from all pads and put it in the frame queue.
+ *
+ * @param cfg The pointer to the snescon_config structure
+ */
+static void snescon_capture(struct snescon_config *cfg) {
+	u64 start = ktime_get_ns();
+	struct pads_frame frame = { .time = start };
+	unsigned char captured;
+
+	if (cfg->replay) {
+		if (cfg->replay_realtime) {
+			snescon_replay(cfg, start);
+		}
+		return;
+	}
+
+	captured = pads_capture(&(cfg->pads_cfg), &frame);
+
+	// Running average of the capture time, for comparing builds and GPIO sources
+	cfg->capture_ns += ((s64) (ktime_get_ns() - start) - (s64) cfg->capture_ns) / 8;
+
+	if (captured) {
+		// The frame is dropped if the work has fallen behind
+		if (!kfifo_put(&cfg->frames, frame)) {
+			cfg->dropped_frames++;
+		}
+	}
+}
+
+/**
+ * Timer that captures a frame from all pads and hands it over to the work.
+ * When the GPIO access can sleep the capture is left to the work as well.
  * 
- * @param ptr The pointer to the snescon_config structure
+ * @param cfg The pointer to the snescon_config structure
  */
+static void snescon_tick(struct snescon_config *cfg) {
+	if (!gpio_backend_sleeps()) {
+		snescon_capture(cfg);
+	}
+	queue_work(system_highpri_wq, &cfg->work);
+	mod_timer(&cfg->timer, jiffies + snescon_refresh_time(cfg));
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+static void snescon_timer(struct timer_list *timer) {
+	struct snescon_config* cfg = from_timer(cfg, timer, timer);
+	snescon_tick(cfg);
+}
+#else
 static void snescon_timer(unsigned long ptr) {
-	struct snescon_config* cfg = (void *) ptr;
-	pads_update(&(cfg->pads_cfg));
-	mod_timer(&cfg->timer, jiffies + REFRESH_TIME);
+	snescon_tick((struct snescon_config *) ptr);
+}
+#endif
+
+/**
+ * Work that decodes all queued frames and reports them.
+ *
+ * @param work The work of the snescon_config structure
+ */
+static void snescon_work(struct work_struct *work) {
+	struct snescon_config* cfg = container_of(work, struct snescon_config, work);
+	struct pads_frame frame;
+
+	if (gpio_backend_sleeps()) {
+		snescon_capture(cfg);
+	}
+
+	while (kfifo_get(&cfg->frames, &frame)) {
+		snescon_decode(cfg, &frame);
+	}
+
+	// Replaying as fast as possible, decode the frames directly from the replay queue
+	if (cfg->replay && !cfg->replay_realtime) {
+		while (kfifo_get(&cfg->replayed, &frame)) {
+			snescon_decode(cfg, &frame);
+		}
+		wake_up_interruptible(&cfg->replay_wait);
+	}
+}
+
+/**
+ * Read recorded frames. Blocks until at least one frame is recorded unless opened with O_NONBLOCK.
+ *
+ * @return Number of bytes read, a multiple of the frame size
+ */
+static ssize_t snescon_read(struct file *file, char __user *buf, size_t len, loff_t *off) {
+	struct snescon_config* cfg = container_of(file->private_data, struct snescon_config, misc);
+	unsigned int copied = 0;
+	int status;
+
+	if (len < sizeof(struct pads_frame)) {
+		return -EINVAL;
+	}
+
+	while (copied == 0) {
+		if (kfifo_is_empty(&cfg->recorded) && (file->f_flags & O_NONBLOCK)) {
+			return -EAGAIN;
+		}
+		status = wait_event_interruptible(cfg->record_wait, !kfifo_is_empty(&cfg->recorded));
+		if (status) {
+			return status;
+		}
+
+		if (mutex_lock_interruptible(&cfg->record_mutex)) {
+			return -ERESTARTSYS;
+		}
+		status = kfifo_to_user(&cfg->recorded, buf, len, &copied);
+		mutex_unlock(&cfg->record_mutex);
+		if (status) {
+			return status;
+		}
+	}
+
+	return copied;
+}
+
+/**
+ * Write frames to replay. Only with source=replay. Blocks while the replay queue is full.
+ *
+ * @return Number of bytes written
+ */
+static ssize_t snescon_write(struct file *file, const char __user *buf, size_t len, loff_t *off) {
+	struct snescon_config* cfg = container_of(file->private_data, struct snescon_config, misc);
+	unsigned int copied;
+	size_t done = 0;
+	int status = 0;
+
+	if (!cfg->replay) {
+		return -EPERM;
+	}
+	if (len % sizeof(struct pads_frame)) {
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&cfg->replay_mutex)) {
+		return -ERESTARTSYS;
+	}
+
+	while (done < len) {
+		status = wait_event_interruptible(cfg->replay_wait, !kfifo_is_full(&cfg->replayed));
+		if (status) {
+			break;
+		}
+		status = kfifo_from_user(&cfg->replayed, buf + done, len - done, &copied);
+		if (status) {
+			break;
+		}
+		done += copied;
+
+		if (!cfg->replay_realtime) {
+			queue_work(system_highpri_wq, &cfg->work);
+		}
+	}
+
+	mutex_unlock(&cfg->replay_mutex);
+	return done ? done : status;
+}
+
+/**
+ * Poll for recorded frames to read and for space in the replay queue. Writing is always possible without
+ * blocking when not replaying, it fails at once.
+ *
+ * @return Mask of the operations that do not block
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+static __poll_t snescon_poll(struct file *file, poll_table *wait) {
+	__poll_t mask = 0;
+#else
+static unsigned int snescon_poll(struct file *file, poll_table *wait) {
+	unsigned int mask = 0;
+#endif
+	struct snescon_config* cfg = container_of(file->private_data, struct snescon_config, misc);
+
+	poll_wait(file, &cfg->record_wait, wait);
+	poll_wait(file, &cfg->replay_wait, wait);
+
+	if (!kfifo_is_empty(&cfg->recorded)) {
+		mask |= POLLIN | POLLRDNORM;
+	}
+	if (!cfg->replay || !kfifo_is_full(&cfg->replayed)) {
+		mask |= POLLOUT | POLLWRNORM;
+	}
+	return mask;
 }
 
+static const struct file_operations snescon_fops = {
+	.owner = THIS_MODULE,
+	.read = snescon_read,
+	.write = snescon_write,
+	.poll = snescon_poll,
+	.llseek = noop_llseek,
+};
+
 /**
  * @brief Open function for the driver.
  * Enables the 
@@ -716,9 +1858,9 @@ static int snescon_open(struct input_dev* dev) {
 	}
 
 	cfg->driver_usage_cnt++;
-	if (cfg->driver_usage_cnt > 0) {
+	if (cfg->driver_usage_cnt > 0 && !cfg->stopping) {
 		// Atleast one device open. Start the timer or reset the timeout.
-		mod_timer(&cfg->timer, jiffies + REFRESH_TIME);
+		mod_timer(&cfg->timer, jiffies + snescon_refresh_time(cfg));
 	}
 
 	mutex_unlock(&cfg->mutex);
@@ -735,8 +1877,18 @@ static void snescon_close(struct input_dev* dev) {
 	mutex_lock(&cfg->mutex);
 	cfg->driver_usage_cnt--;
 	if (cfg->driver_usage_cnt <= 0) {
-		// Last device closed. Disable the timer.
+		// Last device closed. Disable the timer and the work and throw away frames not yet decoded.
 		del_timer_sync(&cfg->timer);
+		cancel_work_sync(&cfg->work);
+		kfifo_reset(&cfg->frames);
+
+		// Replaying at the original timing continues from the next queued frame when a device is opened again
+		cfg->replay_started = false;
+
+		// Replaying as fast as possible does not depend on the devices being open. Keep it going.
+		if (cfg->replay && !cfg->replay_realtime && !kfifo_is_empty(&cfg->replayed) && !cfg->stopping) {
+			queue_work(system_highpri_wq, &cfg->work);
+		}
 	}
 	mutex_unlock(&cfg->mutex);
 }
@@ -746,13 +1898,22 @@ static void snescon_close(struct input_dev* dev) {
  *
  */
 static struct snescon_config snescon_config = {
-	.gpio_id = {2, 3, 4, 7, 10, 11}, // Default values for the GPIOs.
+	.gpio_id = { DEFAULT_GPIO }, // Default values for the GPIOs.
 	.gpio_id_cnt = NUMBER_OF_GPIOS,
+	.source = DEFAULT_SOURCE,
+	.refresh_rate = REFRESH_RATE,
 	.pads_cfg.device_name = "SNES pad",
 	.pads_cfg.open = &snescon_open,
 	.pads_cfg.close = &snescon_close,
-	.pads_cfg.multitap_enabled = 1,
-	.pads_cfg.fourscore_enabled = 1,
+	.pads_cfg.multitap_enabled = DEFAULT_MULTITAP,
+	.pads_cfg.fourscore_enabled = DEFAULT_FOURSCORE,
+	.pads_cfg.dead_frames = 100,
+	.replay_realtime = 1,
+	.misc = {
+		.minor = MISC_DYNAMIC_MINOR,
+		.name = KBUILD_MODNAME,
+		.fops = &snescon_fops,
+	},
 };
 
 /**
@@ -761,18 +1922,118 @@ static struct snescon_config snescon_config = {
 module_param_array_named(gpio, snescon_config.gpio_id, uint, &(snescon_config.gpio_id_cnt), S_IRUGO);
 MODULE_PARM_DESC(gpio, "Mapping of the 6 gpio for the driver are as follow: <clk, latch, port1_d0 (data1), port2_d0 (data2), port2_d1 (data4), port2_pp (data6)>");
 
+/**
+ * @brief Definition of module parameter source. This parameter are readable from the sysfs.
+ */
+module_param_named(source, snescon_config.source, charp, S_IRUGO);
+MODULE_PARM_DESC(source, "GPIO source: raw = GPIO registers, sim = simulated gamepads without hardware, gpiod = GPIO descriptors through gpiolib, replay = frames written to /dev/" KBUILD_MODNAME ". (" DEFAULT_SOURCE " by default.)");
+
+/**
+ * @brief Definition of module parameter peri_base. This parameter are readable from the sysfs.
+ */
+module_param(peri_base, ulong, S_IRUGO);
+MODULE_PARM_DESC(peri_base, "Peripheral base address for source=raw: 0x20000000 on Pi 1 and Zero, 0x3F000000 on Pi 2 and 3. (0x20000000 by default.)");
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+/**
+ * @brief Definition of module parameter gpio_chip. This parameter are readable from the sysfs.
+ */
+module_param_named(gpio_chip, desc_chip, charp, S_IRUGO);
+MODULE_PARM_DESC(gpio_chip, "Label of the GPIO chip for source=gpiod: pinctrl-bcm2835 on Pi 1-3, pinctrl-bcm2711 on Pi 4 or the label of a gpio-sim chip. (pinctrl-bcm2835 by default.)");
+#endif
+
+/**
+ * @brief Definition of module parameter sim_buttons. This parameter are readable and writable from the sysfs.
+ */
+module_param_array(sim_buttons, uint, NULL, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sim_buttons, "Pressed buttons of the simulated gamepads <port 1, port 2> when source=sim. Bit 0-11: B, Y, Select, Start, Up, Down, Left, Right, A, X, L, R.");
+
+/**
+ * @brief Definition of module parameter refresh_rate. This parameter are readable and writable from the sysfs.
+ */
+module_param_named(refresh_rate, snescon_config.refresh_rate, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(refresh_rate, "Number of updates per second, at most HZ. (" __stringify(REFRESH_RATE) " by default.)");
+
 /**
  * @brief Definition of module parameter multitap_enabled. This parameter are readable and writable from the sysfs.
+ * Only readable in a fixed wiring build.
  */
-module_param_named(multitap, snescon_config.pads_cfg.multitap_enabled, bool, S_IRUGO | S_IWUSR);
+module_param_named(multitap, snescon_config.pads_cfg.multitap_enabled, bool, ACCESSORY_PARAM_PERM);
 MODULE_PARM_DESC(multitap, "Enable/disable multitap. (Enabled by default.)");
 
 /**
  * @brief Definition of module parameter fourscore_enabled. This parameter are readable and writable from the sysfs.
+ * Only readable in a fixed wiring build.
  */
-module_param_named(fourscore, snescon_config.pads_cfg.fourscore_enabled, bool, S_IRUGO | S_IWUSR);
+module_param_named(fourscore, snescon_config.pads_cfg.fourscore_enabled, bool, ACCESSORY_PARAM_PERM);
 MODULE_PARM_DESC(en_fourscore, "Enable/disable fourscore. (Enabled by default.)");
 
+/**
+ * @brief Definition of module parameter dpad. This parameter are readable from the sysfs.
+ */
+module_param_named(dpad, snescon_config.pads_cfg.dpad_mode, uint, S_IRUGO);
+MODULE_PARM_DESC(dpad, "How the d-pad is reported: 0 = ABS_X/ABS_Y axes, 1 = BTN_DPAD_* buttons, 2 = ABS_HAT0X/ABS_HAT0Y hat. (Axes by default.)");
+
+/**
+ * @brief Definition of module parameter aggregate. This parameter are readable from the sysfs.
+ */
+module_param_named(aggregate, snescon_config.pads_cfg.aggregate, bool, S_IRUGO);
+MODULE_PARM_DESC(aggregate, "Report all players through one input device. (Disabled by default.)");
+
+/**
+ * @brief Definition of the link health counters. These parameters are readable from the sysfs.
+ */
+module_param_array_named(frames, snescon_config.pads_cfg.frames, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(frames, "Number of frames read <port 1, port 2>.");
+module_param_array_named(invalid_frames, snescon_config.pads_cfg.invalid_frames, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(invalid_frames, "Number of frames with an invalid signature <port 1, port 2>.");
+module_param_array_named(disconnected_frames, snescon_config.pads_cfg.disconnected_frames, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(disconnected_frames, "Number of all-ones (disconnected) frames <port 1, port 2>.");
+module_param_array_named(accessory_changes, snescon_config.pads_cfg.accessory_changes, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(accessory_changes, "Number of times a Multitap or Four Score was detected or lost <port 1, port 2>.");
+
+/**
+ * @brief Definition of module parameter dropped_frames. This parameter are readable from the sysfs.
+ */
+module_param_named(dropped_frames, snescon_config.dropped_frames, uint, S_IRUGO);
+MODULE_PARM_DESC(dropped_frames, "Number of captured frames dropped because the decoding had fallen behind.");
+
+/**
+ * @brief Definition of module parameter capture_ns. This parameter are readable from the sysfs.
+ */
+module_param_named(capture_ns, snescon_config.capture_ns, uint, S_IRUGO);
+MODULE_PARM_DESC(capture_ns, "Average time in ns spent capturing a frame.");
+
+/**
+ * @brief Definition of module parameter record. This parameter are readable and writable from the sysfs.
+ */
+module_param_named(record, snescon_config.record, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(record, "Record decoded frames, readable from /dev/" KBUILD_MODNAME ". (Disabled by default.)");
+
+/**
+ * @brief Definition of module parameter record_dropped. This parameter are readable from the sysfs.
+ */
+module_param_named(record_dropped, snescon_config.record_dropped, uint, S_IRUGO);
+MODULE_PARM_DESC(record_dropped, "Number of recorded frames dropped because they were not read in time.");
+
+/**
+ * @brief Definition of module parameter replay_realtime. This parameter are readable from the sysfs.
+ */
+module_param_named(replay_realtime, snescon_config.replay_realtime, bool, S_IRUGO);
+MODULE_PARM_DESC(replay_realtime, "With source=replay, replay frames at their original timing or as fast as possible. (Original timing by default.)");
+
+/**
+ * @brief Definition of module parameter dead_frames. This parameter are readable and writable from the sysfs.
+ */
+module_param_named(dead_frames, snescon_config.pads_cfg.dead_frames, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(dead_frames, "Number of disconnected frames in a row before a port is no longer reported. 0 = never. (100 by default.)");
+
+/**
+ * @brief Definition of module parameter dead_skip_scan. This parameter are readable and writable from the sysfs.
+ */
+module_param_named(dead_skip_scan, snescon_config.pads_cfg.dead_skip_scan, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(dead_skip_scan, "Only clock dead ports every " __stringify(DEAD_PORT_PROBE_INTERVAL) " update. (Disabled by default.)");
+
 /**
  * Init function for the driver.
  */
@@ -786,21 +2047,74 @@ static int __init snescon_init(void) {
 		return -EINVAL;
 	}
 
-	// Final validation of the provided configuration.
-	if (!gpio_list_valid(snescon_config.gpio_id, snescon_config.gpio_id_cnt)) {
+	// Final validation of the provided configuration. The P1 header only applies to the GPIO registers,
+	// with gpiod the lines are validated by gpiolib when they are requested.
+	for (i = 0; i < NUMBER_OF_GPIOS; ++i) {
+		if (snescon_config.gpio_id[i] >= NUMBER_OF_GPIO_BITS) {
+			pr_err("GPIO %u is out of range\n", snescon_config.gpio_id[i]);
+			return -EINVAL;
+		}
+	}
+	if (strcmp(snescon_config.source, "raw") == 0 &&
+	    !gpio_list_valid(snescon_config.gpio_id, snescon_config.gpio_id_cnt)) {
 		pr_err("One of the GPIO pins in the configuration are not valid!\n");
 		return -EINVAL;
 	}
 
+	if (snescon_config.pads_cfg.dpad_mode > DPAD_HAT) {
+		pr_err("Unknown d-pad mode %u\n", snescon_config.pads_cfg.dpad_mode);
+		return -EINVAL;
+	}
+
+	// There are not enough distinct d-pad buttons or hats for all players on one device.
+	if (snescon_config.pads_cfg.aggregate && snescon_config.pads_cfg.dpad_mode != DPAD_AXES) {
+		pr_err("Aggregated mode only supports the d-pad reported as axes\n");
+		return -EINVAL;
+	}
+
+#ifdef SNESCON_FIXED
+	// The wiring is part of the build. Refuse a configuration that does not match it.
+	for (i = 0; i < NUMBER_OF_GPIOS; ++i) {
+		if (snescon_config.gpio_id[i] != fixed_gpio_id[i]) {
+			pr_err("Built for fixed wiring, gpio must be " __stringify(SNESCON_FIXED_GPIO) "\n");
+			return -EINVAL;
+		}
+	}
+	if (snescon_config.pads_cfg.multitap_enabled != SNESCON_FIXED_MULTITAP ||
+	    snescon_config.pads_cfg.fourscore_enabled != SNESCON_FIXED_FOURSCORE) {
+		pr_err("Built for fixed wiring, multitap and fourscore can not be changed\n");
+		return -EINVAL;
+	}
+#endif
+
 	// Fill in the gpio struct with bit values.
 	for (i = 0; i < NUMBER_OF_GPIOS; ++i) {
 		snescon_config.pads_cfg.gpio[i] = gpio_get_bit(snescon_config.gpio_id[i]);
 	}
 
+	// Initiate the mutexes, the frame queues, the work and the timer. The input devices can be opened
+	// as soon as pads_setup() has registered them.
+	mutex_init(&snescon_config.mutex);
+	mutex_init(&snescon_config.record_mutex);
+	mutex_init(&snescon_config.replay_mutex);
+	init_waitqueue_head(&snescon_config.record_wait);
+	init_waitqueue_head(&snescon_config.replay_wait);
+	INIT_KFIFO(snescon_config.frames);
+	INIT_KFIFO(snescon_config.recorded);
+	INIT_KFIFO(snescon_config.replayed);
+	snescon_config.replay = (strcmp(snescon_config.source, "replay") == 0);
+	INIT_WORK(&snescon_config.work, snescon_work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+	timer_setup(&snescon_config.timer, snescon_timer, 0);
+#else
+	setup_timer(&snescon_config.timer, snescon_timer, (long) &snescon_config);
+#endif
+
 	// Set up the gpio handler.
-	if (gpio_init() != 0) {
+	status = gpio_init(snescon_config.source, snescon_config.pads_cfg.gpio);
+	if (status != 0) {
 		pr_err("Setup of the gpio handler failed\n");
-		return -EBUSY;
+		return status;
 	}
 
 	status = pads_setup(&snescon_config.pads_cfg);
@@ -813,9 +2127,17 @@ static int __init snescon_init(void) {
 		return status;
 	}
 
-	// Initiate the mutex and the timer
-	mutex_init(&snescon_config.mutex);
-	setup_timer(&snescon_config.timer, snescon_timer, (long) &snescon_config);
+	// Record and replay device
+	status = misc_register(&snescon_config.misc);
+	if (status != 0) {
+		pr_err("Could not register /dev/" KBUILD_MODNAME "\n");
+
+		// Cleanup allocated resourses
+		pads_remove(&snescon_config.pads_cfg);
+		gpio_exit();
+
+		return status;
+	}
 	
 	pr_info("Loaded driver\n");
 
@@ -826,9 +2148,19 @@ static int __init snescon_init(void) {
  * Exit function for the driver.
  */
 static void __exit snescon_exit(void) {
-	del_timer(&snescon_config.timer);
+	misc_deregister(&snescon_config.misc);
+
+	// Closing the input devices in pads_remove() must not start the timer or the work again
+	mutex_lock(&snescon_config.mutex);
+	snescon_config.stopping = true;
+	mutex_unlock(&snescon_config.mutex);
+
+	del_timer_sync(&snescon_config.timer);
+	cancel_work_sync(&snescon_config.work);
 	pads_remove(&snescon_config.pads_cfg);
 	mutex_destroy(&snescon_config.mutex);
+	mutex_destroy(&snescon_config.record_mutex);
+	mutex_destroy(&snescon_config.replay_mutex);
 	gpio_exit();
 
 	pr_info("driver exit\n");
@@ -0,0 +1,419 @@
+/*
+ * Input latency measurement for the NES, SNES, gamepad driver for Raspberry Pi
+ *
+ * Presses and releases a button on the simulated gamepad (source=sim) and measures the time until the
+ * matching event can be read from the input device. Runs on any Linux machine, no Raspberry Pi needed.
+ *
+ * Build:
+ *   gcc -O2 -Wall -o tools/snescon_latency tools/snescon_latency.c
+ *
+ * Usage:
+ *   sudo modprobe snescon_gpio_rpi source=sim
+ *   sudo tools/snescon_latency [-d /dev/input/eventN] [-n samples] [-p port] [-b button] [-r rate,rate,...] [-l max_p99_us]
+ *
+ * Two latencies are reported for every sample, both measured from the write to sim_buttons:
+ *   event: Timestamp of the event, set by the input core when the driver reported it.
+ *   read:  Time when the event was read from the input device in userspace.
+ *
+ * With -r the refresh_rate parameter is set to each of the given rates in turn and one distribution is
+ * reported per rate. The original refresh_rate is restored afterwards.
+ *
+ * With -l the program exits with status 1 if the 99th percentile of the read latency exceeds the
+ * given number of microseconds at any of the rates. make check builds the driver and this program and
+ * runs it that way.
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PARAMETERS "/sys/module/snescon_gpio_rpi/parameters/"
+#define DEVICE_NAME "SNES pad"
+#define TIMEOUT_MS 1000
+
+// The order that the buttons of the keymap are shifted out by the gamepad (bit in sim_buttons)
+static const unsigned char btn_index[] = { 0, 1, 2, 3, 8, 9, 10, 11 };
+
+/**
+ * Current time of CLOCK_MONOTONIC in nanoseconds.
+ */
+static long long now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Read a module parameter.
+ *
+ * @param name Name of the parameter
+ * @param buf Buffer to store the value in
+ * @param len Size of buf
+ * @return 0 on success, otherwise -1
+ */
+static int param_read(const char *name, char *buf, size_t len) {
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), PARAMETERS "%s", name);
+	f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+	if (!fgets(buf, len, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+/**
+ * Find the input device of player 1.
+ *
+ * @param path Buffer to store the path of the device in
+ * @param len Size of path
+ * @return 0 on success, otherwise -1
+ */
+static int device_find(char *path, size_t len) {
+	char name[64], phys[64];
+	struct dirent *entry;
+	DIR *dir;
+	int fd;
+
+	dir = opendir("/dev/input");
+	if (!dir) {
+		return -1;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "event", 5) != 0) {
+			continue;
+		}
+		snprintf(path, len, "/dev/input/%s", entry->d_name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			continue;
+		}
+		memset(name, 0, sizeof(name));
+		memset(phys, 0, sizeof(phys));
+		ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name);
+		ioctl(fd, EVIOCGPHYS(sizeof(phys) - 1), phys);
+		close(fd);
+		if (strcmp(name, DEVICE_NAME) == 0 && strcmp(phys, "input0") == 0) {
+			closedir(dir);
+			return 0;
+		}
+	}
+
+	closedir(dir);
+	return -1;
+}
+
+/**
+ * Wait for a key event on the input device.
+ *
+ * @param fd The input device
+ * @param code Key code to wait for
+ * @param value Value to wait for
+ * @param event_ns Where to store the timestamp of the event
+ * @return 0 on success, otherwise -1
+ */
+static int event_wait(int fd, unsigned int code, int value, long long *event_ns) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct input_event ev;
+
+	for (;;) {
+		if (poll(&pfd, 1, TIMEOUT_MS) <= 0) {
+			return -1;
+		}
+		if (read(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+			return -1;
+		}
+		if (ev.type == EV_KEY && ev.code == code && ev.value == value) {
+			*event_ns = ev.input_event_sec * 1000000000LL + ev.input_event_usec * 1000LL;
+			return 0;
+		}
+	}
+}
+
+/**
+ * Release all buttons of the simulated gamepads and throw away the events that causes, so a button left
+ * pressed by an aborted run does not hide the first press.
+ *
+ * @param sim The sim_buttons parameter
+ * @param fd The input device
+ * @param period_ns Time between two updates of the driver
+ * @return 0 on success, otherwise -1
+ */
+static int buttons_reset(int sim, int fd, long long period_ns) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct input_event ev;
+
+	if (pwrite(sim, "0,0\n", 4, 0) < 0) {
+		return -1;
+	}
+	usleep(3 * period_ns / 1000);
+	while (poll(&pfd, 1, 0) > 0 && read(fd, &ev, sizeof(ev)) == sizeof(ev)) {
+	}
+	return 0;
+}
+
+static int compare(const void *a, const void *b) {
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Sort the samples and print the latency distribution.
+ *
+ * @param label Name of the latency
+ * @param ns Samples in nanoseconds
+ * @param n Number of samples
+ * @return The 99th percentile in nanoseconds
+ */
+static long long report(const char *label, long long *ns, int n) {
+	static const double pct[] = { 50, 90, 99, 99.9 };
+	long long p99 = 0;
+	int i, idx;
+
+	qsort(ns, n, sizeof(ns[0]), compare);
+	printf("%-6s min %7.1f", label, ns[0] / 1000.0);
+	for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+		idx = (int) (pct[i] / 100.0 * (n - 1) + 0.5);
+		printf("  p%-4g %7.1f", pct[i], ns[idx] / 1000.0);
+		if (pct[i] == 99) {
+			p99 = ns[idx];
+		}
+	}
+	printf("  max %7.1f us\n", ns[n - 1] / 1000.0);
+	return p99;
+}
+
+/**
+ * Write a module parameter.
+ *
+ * @param name Name of the parameter
+ * @param value Value to write
+ * @return 0 on success, otherwise -1
+ */
+static int param_write(const char *name, const char *value) {
+	char path[128];
+	FILE *f;
+	int status;
+
+	snprintf(path, sizeof(path), PARAMETERS "%s", name);
+	f = fopen(path, "w");
+	if (!f) {
+		return -1;
+	}
+	status = fputs(value, f) < 0 ? -1 : 0;
+	if (fclose(f)) {
+		status = -1;
+	}
+	return status;
+}
+
+/**
+ * Press and release the button the given number of times and measure the latency of every event.
+ *
+ * @param fd The input device
+ * @param sim The sim_buttons parameter
+ * @param code Key code of the button
+ * @param port Port of the simulated gamepad
+ * @param button Button on the gamepad
+ * @param period_ns Time between two updates of the driver
+ * @param event_ns Where to store the event latencies
+ * @param read_ns Where to store the read latencies
+ * @param samples Number of samples
+ * @return 0 on success, otherwise -1
+ */
+static int measure(int fd, int sim, unsigned int code, int port, int button, long long period_ns,
+		long long *event_ns, long long *read_ns, int samples) {
+	char buf[32];
+	long long t0, t_event;
+	int i, value;
+
+	if (buttons_reset(sim, fd, period_ns)) {
+		perror("sim_buttons");
+		return -1;
+	}
+
+	for (i = 0; i < samples; i++) {
+		value = !(i & 1);
+		snprintf(buf, sizeof(buf), port == 1 ? "%u,0\n" : "0,%u\n", value ? 1u << btn_index[button] : 0);
+
+		t0 = now_ns();
+		if (pwrite(sim, buf, strlen(buf), 0) < 0) {
+			perror("sim_buttons");
+			return -1;
+		}
+		if (event_wait(fd, code, value, &t_event)) {
+			fprintf(stderr, "Timeout waiting for sample %d\n", i);
+			return -1;
+		}
+		read_ns[i] = now_ns() - t0;
+		event_ns[i] = t_event - t0;
+
+		// Spread the next press over two refresh periods so it does not lock to the phase of the timer
+		usleep((period_ns + rand() % (2 * period_ns)) / 1000);
+	}
+	return 0;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-d device] [-n samples] [-p port] [-b button] [-r rate,rate,...] [-l max_p99_us]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	char path[300] = "", source[16] = "", rate[16] = "", aggregate[4] = "";
+	char *rates = NULL, *next;
+	unsigned int keymap[2];
+	long long *event_ns, *read_ns;
+	long long limit_us = 0, period_ns;
+	int samples = 1000, port = 1, button = 0, status = 0;
+	int fd, sim, opt;
+	int clock = CLOCK_MONOTONIC;
+
+	while ((opt = getopt(argc, argv, "d:n:p:b:r:l:")) != -1) {
+		switch (opt) {
+		case 'd':
+			snprintf(path, sizeof(path), "%s", optarg);
+			break;
+		case 'n':
+			samples = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'b':
+			button = atoi(optarg);
+			break;
+		case 'r':
+			rates = optarg;
+			break;
+		case 'l':
+			limit_us = atoll(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (samples < 1 || port < 1 || port > 2 || button < 0 || button > 7) {
+		usage(argv[0]);
+	}
+
+	if (param_read("source", source, sizeof(source)) || strcmp(source, "sim") != 0) {
+		fprintf(stderr, "snescon_gpio_rpi must be loaded with source=sim\n");
+		return 2;
+	}
+	param_read("refresh_rate", rate, sizeof(rate));
+	param_read("aggregate", aggregate, sizeof(aggregate));
+
+	if (path[0] == '\0') {
+		if (port == 2 && aggregate[0] != 'Y') {
+			fprintf(stderr, "Use -d to select the input device of port 2\n");
+			return 2;
+		}
+		if (device_find(path, sizeof(path))) {
+			fprintf(stderr, "No " DEVICE_NAME " input device found\n");
+			return 2;
+		}
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return 2;
+	}
+	ioctl(fd, EVIOCSCLOCKID, &clock);
+
+	// Look up the key code of the button in the keymap of the pad on the port
+	keymap[0] = button;
+	if (aggregate[0] == 'Y') {
+		keymap[0] += (port - 1) * 8;
+	}
+	if (ioctl(fd, EVIOCGKEYCODE, keymap)) {
+		perror("EVIOCGKEYCODE");
+		return 2;
+	}
+
+	sim = open(PARAMETERS "sim_buttons", O_WRONLY);
+	if (sim < 0) {
+		perror(PARAMETERS "sim_buttons");
+		return 2;
+	}
+
+	event_ns = calloc(samples, sizeof(*event_ns));
+	read_ns = calloc(samples, sizeof(*read_ns));
+	if (!event_ns || !read_ns) {
+		return 2;
+	}
+
+	srand(time(NULL));
+
+	printf("%s: source %s, aggregate %s, key 0x%x, %d samples per refresh_rate\n",
+	       path, source, aggregate, keymap[1], samples);
+
+	// Without -r only the current refresh_rate is measured
+	next = rates ? rates : rate;
+	while (next && status != 2) {
+		char current[16];
+
+		snprintf(current, sizeof(current), "%.*s", (int) strcspn(next, ","), next);
+		next = strchr(next, ',');
+		if (next) {
+			next++;
+		}
+
+		if (rates && param_write("refresh_rate", current)) {
+			perror(PARAMETERS "refresh_rate");
+			status = 2;
+			break;
+		}
+		period_ns = 1000000000LL / (atoi(current) > 0 ? atoi(current) : 100);
+
+		printf("refresh_rate %s\n", current);
+		if (measure(fd, sim, keymap[1], port, button, period_ns, event_ns, read_ns, samples)) {
+			status = 2;
+			break;
+		}
+		report("event", event_ns, samples);
+		if (report("read", read_ns, samples) > limit_us * 1000 && limit_us) {
+			fprintf(stderr, "p99 read latency above %lld us at refresh_rate %s\n", limit_us, current);
+			status = 1;
+		}
+	}
+
+	// Leave the driver as it was found
+	if (rates) {
+		param_write("refresh_rate", rate);
+	}
+	pwrite(sim, "0,0\n", 4, 0);
+
+	return status;
+}